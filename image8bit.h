@@ -13,6 +13,7 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -36,7 +37,9 @@ typedef struct image *Image;
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, set names of counters and open the hardware events, before
+/// any worker thread is created, so that the events of workers are counted.
+/// (Instrumentation is calibrated only when needed: see InstrGetCTU.)
 void ImageInit(void) ;
 
 /// Image management functions
@@ -58,6 +61,33 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Images are allocated from a pool that keeps the buffers of destroyed
+/// images for reuse (see poolhits and poolmisses in the instrumentation).
+/// Set the maximum number of bytes kept in free buffers by the pool
+/// (256 MB, or IMAGE8BIT_POOL bytes if set in the environment; 0 disables
+/// the pool).  Free buffers above the new limit are returned to the system.
+void ImageSetPoolLimit(size_t bytes) ;
+
+/// Create a view of a rectangular area of img.
+/// The rectangle is specified by the top left corner coords (x, y) and
+/// width w and height h.
+/// A view is an image that shares the pixels of img, without copying:
+/// changes to the pixels of the view are visible in img, and vice-versa.
+/// It can be used with every function of this module, like any other image.
+/// Views must also be destroyed with ImageDestroy, and img may be destroyed
+/// before its views (the pixels are freed when no views remain).
+/// Views of the same image may be created and destroyed by different
+/// threads at the same time (but writing the shared pixels is up to them).
+/// Requires:
+///   The rectangle must be inside img.
+/// Ensures:
+///   The returned image has width w and height h.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageView(Image img, int x, int y, int w, int h) ;
+
 /// PGM file operations
 
 /// Load a raw PGM file.
@@ -67,12 +97,81 @@ void ImageDestroy(Image* imgp) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Load a raw PGM file by mapping it into memory.
+/// Like ImageLoad, but only the header is read: the pixels are used
+/// directly from the mapped file, and each page is only read from disk when
+/// first accessed.  The mapping is private (copy-on-write), so changes to
+/// the image are never written to the file.
+/// On systems without mmap, this is the same as ImageLoad.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename) ;
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) ;
 
+/// Row-band access to PGM files
+
+/// These functions read and write raw PGM files a band of rows at a time,
+/// so that images larger than the available memory may be processed.
+/// A band is just an image with the same width as the file (it may be a view
+/// of a larger buffer).
+
+// Type PGMStream is a pointer to PGM files opened for row access
+typedef struct pgmstream *PGMStream;
+
+/// Open a raw PGM file for reading by rows.
+/// Only the header is read.
+/// On success, a new stream is returned.
+/// (The caller is responsible for closing the returned stream!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+PGMStream PGMStreamOpen(const char* filename) ;
+
+/// Create a raw PGM file for writing by rows, and write its header.
+///   width, height, maxval: as in ImageCreate.
+/// Requires: width and height must be non-negative, maxval > 0.
+/// On success, a new stream is returned.
+/// (The caller is responsible for closing the returned stream!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+PGMStream PGMStreamCreate(const char* filename, int width, int height, uint8 maxval) ;
+
+/// Close the stream pointed to by (*psp).
+/// For streams being written, all rows must have been written.
+/// If (*psp)==NULL, no operation is performed.
+/// Ensures: (*psp)==NULL.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int PGMStreamClose(PGMStream* psp) ;
+
+/// Get stream image width
+int PGMStreamWidth(PGMStream ps) ;
+
+/// Get stream image height
+int PGMStreamHeight(PGMStream ps) ;
+
+/// Get stream image maximum gray level
+int PGMStreamMaxval(PGMStream ps) ;
+
+/// Read rows y, y+1, ... of the stream image into band.
+/// The number of rows read is the height of band (which may be a view).
+/// Rows may be read in any order, and more than once.
+/// Requires: ps was opened for reading, band has the same width as ps,
+///   and 0 <= y, y + ImageHeight(band) <= PGMStreamHeight(ps).
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int PGMStreamRead(PGMStream ps, int y, Image band) ;
+
+/// Append the rows of band to the stream image.
+/// Requires: ps was created for writing, band has the same width as ps,
+///   and the total number of rows written does not exceed its height.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int PGMStreamWrite(PGMStream ps, Image band) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -112,6 +211,22 @@ uint8 ImageGetPixel(Image img, int x, int y) ;
 /// Set the pixel at position (x,y) to new level.
 void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 
+/// Parallel execution
+
+/// Operations that process rows independently (point operations, blend,
+/// blur, rotations and mirror) split large images in bands of rows that
+/// are processed in parallel.  The results do not depend on the number
+/// of threads.
+
+/// Set the number of threads used by the image operations.
+/// Requires: n >= 0.  Use 0 to select it automatically: the value of the
+/// environment variable IMAGE8BIT_THREADS, if set, or else the number of
+/// processors.  Must not be called while an operation is running.
+void ImageSetThreads(int n) ;
+
+/// Get the number of threads used by the image operations.
+int ImageThreads(void) ;
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
@@ -135,6 +250,45 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Lookup tables
+
+/// Every pixel transformation above changes each pixel according to its
+/// level only, so it may be described by a lookup table (LUT) that gives
+/// the new level for each of the 256 possible levels.
+/// Several such transformations can be composed into a single LUT and then
+/// applied to an image in one pass.
+///
+/// The LUTXxx functions below compose a transformation AFTER the one already
+/// described by lut.  For example, to negate and then threshold at 100:
+///   LUT lut;
+///   LUTIdentity(lut);
+///   LUTNegative(lut);
+///   LUTThreshold(lut, 100);
+///   ImageApplyLUT(img, lut);
+
+// Type LUT is a lookup table with the new level for each level
+typedef uint8 LUT[256];
+
+/// Set lut to the identity transformation.
+void LUTIdentity(LUT lut) ;
+
+/// Compose lut with the transformation of ImageNegative.
+void LUTNegative(LUT lut) ;
+
+/// Compose lut with the transformation of ImageThreshold.
+void LUTThreshold(LUT lut, uint8 thr) ;
+
+/// Compose lut with the transformation of ImageBrighten.
+/// Requires: factor >= 0.0.
+void LUTBrighten(LUT lut, double factor) ;
+
+/// Compose lut with another table: lut[v] becomes next[lut[v]].
+void LUTCompose(LUT lut, const LUT next) ;
+
+/// Replace each pixel level v in img by lut[v].
+/// This modifies img in-place: no allocation involved.
+void ImageApplyLUT(Image img, const LUT lut) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -155,6 +309,30 @@ void ImageBrighten(Image img, double factor) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) ;
 
+/// Rotate an image 90 degrees clockwise.
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateClockwise(Image img) ;
+
+/// Rotate an image 180 degrees.
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) ;
+
+/// Set the tile size used by the blocked geometric transformations.
+/// The rotations process the image in tile x tile blocks, to make good use
+/// of the cache on large images.
+/// Requires: tile >= 0.  Use 0 to select the tile size automatically.
+void ImageSetTileSize(int tile) ;
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -164,6 +342,11 @@ Image ImageRotate(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) ;
 
+/// Mirror an image = flip left-right, in-place.
+/// Same result as ImageMirror, but img itself is modified.
+/// No allocation involved: never fails.
+void ImageMirrorInPlace(Image img) ;
+
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
 /// width w and height h.
@@ -203,14 +386,124 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// Large searches are split among threads (see ImageSetThreads), with the
+/// same result.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Set the number of candidate rows handed out at a time to each thread
+/// by ImageLocateSubImage.
+/// Requires: rows >= 0.  Use 0 to select it automatically.
+void ImageSetLocateChunk(int rows) ;
+
+/// Locate a subimage inside another image, using a 2D rolling hash.
+/// Same result as ImageLocateSubImage, but only positions whose hash
+/// matches the hash of img2 are compared pixel by pixel.
+int ImageLocateSubImageHashed(Image img1, int* px, int* py, Image img2) ;
+
+/// A match found by ImageLocateAll.
+typedef struct {
+  int index;  ///< index of the subimage found
+  int x;      ///< position where it was found
+  int y;
+} ImageMatch;
+
+/// Locate all occurrences of several subimages inside another image.
+/// Searches for each of subimgs[0..n-1] inside img1, in a single pass.
+/// On success, returns the number of matches and sets *pmatches to a
+/// new array with them, sorted by y, x and index (NULL if there are none).
+/// The caller must free() the array.
+/// Empty subimages, or larger than img1, are never found.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLocateAll(Image img1, int n, Image subimgs[], ImageMatch** pmatches) ;
+
+/// Sum of absolute differences (SAD) between img2 and the subimage
+/// of img1 at position (x, y).  It is 0 only if they match exactly.
+/// Requires: img2 must fit inside img1 at position (x, y).
+uint64_t ImageSAD(Image img1, int x, int y, Image img2) ;
+
+/// Locate the best approximate match of a subimage inside another image.
+/// Searches for the position of img1 where the SAD of img2 is smallest,
+/// rejecting positions with a SAD larger than maxsad (use UINT64_MAX
+/// for no limit).  Comparisons stop early when they cannot win.
+/// If a match is found, returns 1, sets the position in (*px, *py) and
+/// the SAD in *psad (if psad is not NULL).  Among equal SADs, the first
+/// position in raster order is chosen.
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int ImageLocateBestSAD(Image img1, int* px, int* py, Image img2, uint64_t maxsad, uint64_t* psad) ;
+
+/// Normalized cross-correlation (NCC) between img2 and the subimage
+/// of img1 at position (x, y).  It is in [-1, 1], and 1 when the levels
+/// of one are an increasing linear function of the levels of the other.
+/// Requires: img2 must fit inside img1 at position (x, y), and not be empty.
+double ImageNCC(Image img1, int x, int y, Image img2) ;
+
+/// Locate the best approximate match of a subimage inside another image.
+/// Searches for the position of img1 where the NCC of img2 is highest,
+/// rejecting positions with a NCC lower than minncc.
+/// Comparisons stop early when they cannot reach the best NCC so far
+/// (or minncc), so a higher minncc also makes the search faster.
+/// If a match is found, returns 1, sets the position in (*px, *py) and
+/// the NCC in *pncc (if pncc is not NULL).  Among equal NCCs, the first
+/// position in raster order is chosen.
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int ImageLocateBestNCC(Image img1, int* px, int* py, Image img2, double minncc, double* pncc) ;
+
+/// Integral images (summed-area tables)
+
+/// An integral image of a WxH image stores, for each position (x,y) with
+/// 0<=x<=W and 0<=y<=H, the sum of the pixel levels inside the rectangle
+/// [0, x[ x [0, y[ of the source image.
+/// Once built, the sum over any rectangular area is obtained in O(1) time,
+/// independently of the size of the area.
+/// An integral image may be rebuilt many times from different images,
+/// as long as they all have the same dimensions.
+
+// Type Integral is a pointer to integral image objects
+typedef struct integral *Integral;
+
+/// Create a new integral image for images of size width x height.
+/// Requires: width and height must be non-negative.
+/// The sums are undefined until IntegralBuild is called.
+/// 
+/// On success, a new integral image is returned.
+/// (The caller is responsible for destroying the returned object!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Integral IntegralCreate(int width, int height) ;
+
+/// Destroy the integral image pointed to by (*iip).
+///   iip : address of an Integral variable.
+/// If (*iip)==NULL, no operation is performed.
+/// Ensures: (*iip)==NULL.
+void IntegralDestroy(Integral* iip) ;
+
+/// Compute the sums of integral image ii from the pixels of img.
+/// Requires: img must have the same width and height as ii.
+void IntegralBuild(Integral ii, Image img) ;
+
+/// Sum of the pixel levels in rectangular area (x,y,w,h).
+/// Requires: the area must be inside the image (w or h may be 0).
+uint64_t IntegralSum(Integral ii, int x, int y, int w, int h) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
+/// The cost per pixel does not depend on dx and dy (uses an Integral).
+/// If the auxiliary memory cannot be allocated, img is left unchanged and
+/// errno/errCause are set accordingly.
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Same result as ImageBlur, but computed with running sums: a vertical
+/// accumulator of column sums slides down the image and each output row is
+/// obtained by sliding a horizontal window over that accumulator.
+/// The auxiliary memory is only O(width*(dy+1)) bytes (one accumulator row
+/// plus the last dy+1 original rows), instead of a full-size Integral.
+/// The image is changed in-place.
+/// If the auxiliary memory cannot be allocated, img is left unchanged and
+/// errno/errCause are set accordingly.
+void ImageBlurSeparable(Image img, int dx, int dy) ;
+
 #endif
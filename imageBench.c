@@ -0,0 +1,443 @@
+// imageBench - Benchmarks for the image8bit module.
+//
+// Synthesizes images of several sizes and patterns, runs each operation of
+// the image8bit module on them (after some warmup runs) a number of times,
+// and writes the median and minimum times, the throughput and the
+// instrumentation counters of each, in JSON or CSV.
+// No image files are needed, so it runs offline.  (The load, save and
+// stream operations use a scratch file, removed at the end.)
+//
+// This program is an example use of the image8bit module,
+// a programming project for the course AED, DETI / UA.PT
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <assert.h>
+#include <errno.h>
+#include "error.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE:\n"
+    "  imageBench [OPTION...]\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -s MP,...       Image sizes in megapixels, 4:3 (default 1,4,16; up to 400)\n"
+    "  -p PAT,...      Patterns: random, gradient, checker, flat (default random,gradient)\n"
+    "  -o OP,...       Operations to run (default all, see below)\n"
+    "  -r N            Timed repetitions of each operation (default 5)\n"
+    "  -w N            Warmup runs of each operation (default 1)\n"
+    "  -t N            Number of threads (default 0 = automatic)\n"
+    "  -f FORMAT       Output format: json or csv (default json)\n"
+    "  -F FILE         Scratch file for the file operations (default imageBench.tmp.pgm)\n"
+    "\n"
+    "OPERATIONS:\n"
+    "  neg thr bri lut rotate rotatecw rotate180 mirror mirrorip crop view\n"
+    "  paste blend blur blurs integral stats locate locateh locateall\n"
+    "  locatesad locatencc save load loadmapped streamread streamwrite\n"
+    ;
+
+// Largest image size accepted (in megapixels)
+#define MAXMP 400.0
+
+// Maximum number of timed repetitions
+#define MAXREPS 1000
+
+// An operation to benchmark.
+// run applies it to img (which it may modify) and to aux (a small image
+// cropped from the bottom right corner of img); pixels is the number of
+// pixels it processes, used to compute the throughput.
+typedef struct {
+  const char* name;
+  void (*run)(Image img, Image aux);
+  double (*pixels)(Image img, Image aux);
+} BenchOp;
+
+static double imgPixels(Image img, Image aux) {
+  return (double)ImageWidth(img) * ImageHeight(img);
+}
+
+static double auxPixels(Image img, Image aux) {
+  return (double)ImageWidth(aux) * ImageHeight(aux);
+}
+
+static double noPixels(Image img, Image aux) {
+  return 0.0;
+}
+
+// Scratch file of the file operations: holds the image being benchmarked.
+static const char* scratch = "imageBench.tmp.pgm";
+
+// Rows per band of the stream operations
+#define STREAMROWS 64
+
+// Destroy a new image returned by an operation; abort if it failed.
+static void consume(Image result, const char* op) {
+  if (result == NULL) {
+    error(2, errno, "%s: %s", op, ImageErrMsg());
+  }
+  ImageDestroy(&result);
+}
+
+// Abort if an operation that returns a success flag failed.
+static void succeed(int ok, const char* op) {
+  if (!ok) {
+    error(2, errno, "%s: %s", op, ImageErrMsg());
+  }
+}
+
+static void runNeg(Image img, Image aux) { ImageNegative(img); }
+static void runThr(Image img, Image aux) { ImageThreshold(img, 128); }
+static void runBri(Image img, Image aux) { ImageBrighten(img, 1.1); }
+static void runLUT(Image img, Image aux) {
+  LUT lut;
+  LUTIdentity(lut);
+  LUTNegative(lut);
+  LUTBrighten(lut, 0.9);
+  ImageApplyLUT(img, lut);
+}
+static void runRotate(Image img, Image aux) { consume(ImageRotate(img), "rotate"); }
+static void runRotateCW(Image img, Image aux) { consume(ImageRotateClockwise(img), "rotatecw"); }
+static void runRotate180(Image img, Image aux) { consume(ImageRotate180(img), "rotate180"); }
+static void runMirror(Image img, Image aux) { consume(ImageMirror(img), "mirror"); }
+static void runMirrorIP(Image img, Image aux) { ImageMirrorInPlace(img); }
+static void runCrop(Image img, Image aux) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  consume(ImageCrop(img, w/4, h/4, w/2, h/2), "crop");
+}
+static void runView(Image img, Image aux) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  consume(ImageView(img, w/4, h/4, w/2, h/2), "view");
+}
+static void runPaste(Image img, Image aux) { ImagePaste(img, 0, 0, aux); }
+static void runBlend(Image img, Image aux) { ImageBlend(img, 0, 0, aux, 0.33); }
+static void runBlur(Image img, Image aux) { ImageBlur(img, 3, 3); }
+static void runBlurS(Image img, Image aux) { ImageBlurSeparable(img, 3, 3); }
+static void runIntegral(Image img, Image aux) {
+  Integral ii = IntegralCreate(ImageWidth(img), ImageHeight(img));
+  if (ii == NULL) {
+    error(2, errno, "integral: %s", ImageErrMsg());
+  }
+  IntegralBuild(ii, img);
+  IntegralDestroy(&ii);
+}
+static void runStats(Image img, Image aux) {
+  uint8 min, max;
+  ImageStats(img, &min, &max);
+}
+static void runLocate(Image img, Image aux) {
+  int x, y;
+  ImageLocateSubImage(img, &x, &y, aux);
+}
+static void runLocateH(Image img, Image aux) {
+  int x, y;
+  ImageLocateSubImageHashed(img, &x, &y, aux);
+}
+// Searches for the four quadrants of aux at once.
+static void runLocateAll(Image img, Image aux) {
+  int w = ImageWidth(aux);
+  int h = ImageHeight(aux);
+  Image subimgs[4] = {
+    ImageView(aux, 0, 0, w/2, h/2), ImageView(aux, w/2, 0, w - w/2, h/2),
+    ImageView(aux, 0, h/2, w/2, h - h/2), ImageView(aux, w/2, h/2, w - w/2, h - h/2),
+  };
+  ImageMatch* matches = NULL;
+  for (int i = 0; i < 4; i++) succeed(subimgs[i] != NULL, "locateall");
+  succeed(ImageLocateAll(img, 4, subimgs, &matches) >= 0, "locateall");
+  free(matches);
+  for (int i = 0; i < 4; i++) ImageDestroy(&subimgs[i]);
+}
+static void runLocateSAD(Image img, Image aux) {
+  int x, y;
+  ImageLocateBestSAD(img, &x, &y, aux, UINT64_MAX, NULL);
+}
+// Positions that cannot reach a NCC of 0.9 are abandoned early.
+static void runLocateNCC(Image img, Image aux) {
+  int x, y;
+  ImageLocateBestNCC(img, &x, &y, aux, 0.9, NULL);
+}
+static void runSave(Image img, Image aux) { succeed(ImageSave(img, scratch), "save"); }
+static void runLoad(Image img, Image aux) { consume(ImageLoad(scratch), "load"); }
+// The pixels of a mapped image are only read when used: the statistics
+// read them all, to make it comparable with load.
+static void runLoadMapped(Image img, Image aux) {
+  Image mapped = ImageLoadMapped(scratch);
+  succeed(mapped != NULL, "loadmapped");
+  uint8 min, max;
+  ImageStats(mapped, &min, &max);
+  ImageDestroy(&mapped);
+}
+static void runStreamRead(Image img, Image aux) {
+  PGMStream ps = PGMStreamOpen(scratch);
+  succeed(ps != NULL, "streamread");
+  int w = PGMStreamWidth(ps);
+  int h = PGMStreamHeight(ps);
+  Image band = ImageCreate(w, STREAMROWS, PixMax);
+  succeed(band != NULL, "streamread");
+  for (int y = 0; y < h; y += STREAMROWS) {
+    int n = (h - y < STREAMROWS) ? h - y : STREAMROWS;
+    Image rows = ImageView(band, 0, 0, w, n);
+    succeed(rows != NULL && PGMStreamRead(ps, y, rows), "streamread");
+    ImageDestroy(&rows);
+  }
+  ImageDestroy(&band);
+  succeed(PGMStreamClose(&ps), "streamread");
+}
+static void runStreamWrite(Image img, Image aux) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  PGMStream ps = PGMStreamCreate(scratch, w, h, (uint8)ImageMaxval(img));
+  succeed(ps != NULL, "streamwrite");
+  for (int y = 0; y < h; y += STREAMROWS) {
+    int n = (h - y < STREAMROWS) ? h - y : STREAMROWS;
+    Image rows = ImageView(img, 0, y, w, n);
+    succeed(rows != NULL && PGMStreamWrite(ps, rows), "streamwrite");
+    ImageDestroy(&rows);
+  }
+  succeed(PGMStreamClose(&ps), "streamwrite");
+}
+
+static const BenchOp ops[] = {
+  {"neg", runNeg, imgPixels},
+  {"thr", runThr, imgPixels},
+  {"bri", runBri, imgPixels},
+  {"lut", runLUT, imgPixels},
+  {"rotate", runRotate, imgPixels},
+  {"rotatecw", runRotateCW, imgPixels},
+  {"rotate180", runRotate180, imgPixels},
+  {"mirror", runMirror, imgPixels},
+  {"mirrorip", runMirrorIP, imgPixels},
+  {"crop", runCrop, imgPixels},
+  {"view", runView, noPixels},
+  {"paste", runPaste, auxPixels},
+  {"blend", runBlend, auxPixels},
+  {"blur", runBlur, imgPixels},
+  {"blurs", runBlurS, imgPixels},
+  {"integral", runIntegral, imgPixels},
+  {"stats", runStats, imgPixels},
+  {"locate", runLocate, imgPixels},
+  {"locateh", runLocateH, imgPixels},
+  {"locateall", runLocateAll, imgPixels},
+  {"locatesad", runLocateSAD, imgPixels},
+  {"locatencc", runLocateNCC, imgPixels},
+  {"save", runSave, imgPixels},
+  {"load", runLoad, imgPixels},
+  {"loadmapped", runLoadMapped, imgPixels},
+  {"streamread", runStreamRead, imgPixels},
+  {"streamwrite", runStreamWrite, imgPixels},
+};
+static const int nops = sizeof(ops) / sizeof(ops[0]);
+
+// Is name in the comma-separated list (NULL = all names)?
+static int inList(const char* list, const char* name) {
+  if (list == NULL) return 1;
+  size_t len = strlen(name);
+  for (const char* p = list; *p != '\0'; ) {
+    size_t n = strcspn(p, ",");
+    if (n == len && strncmp(p, name, len) == 0) return 1;
+    p += n;
+    if (*p == ',') p++;
+  }
+  return 0;
+}
+
+// Synthesize a w x h image with the given pattern (NULL if unknown).
+static Image synthesize(int w, int h, const char* pattern) {
+  int kind;
+  if (strcmp(pattern, "random") == 0) kind = 0;
+  else if (strcmp(pattern, "gradient") == 0) kind = 1;
+  else if (strcmp(pattern, "checker") == 0) kind = 2;
+  else if (strcmp(pattern, "flat") == 0) kind = 3;
+  else return NULL;
+
+  Image img = ImageCreate(w, h, PixMax);
+  if (img == NULL) {
+    error(2, errno, "Creating %dx%d image: %s", w, h, ImageErrMsg());
+  }
+  unsigned int seed = 12345;   // same images in every run
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      uint8 level;
+      switch (kind) {
+        case 0:
+          seed = seed * 1103515245u + 12345u;
+          level = (uint8)(seed >> 23);
+          break;
+        case 1:
+          level = (uint8)((x + y) & 0xff);
+          break;
+        case 2:
+          level = (((x >> 3) ^ (y >> 3)) & 1) ? PixMax : 0;
+          break;
+        default:
+          level = 128;
+          break;
+      }
+      ImageSetPixel(img, x, y, level);
+    }
+  }
+  return img;
+}
+
+static int cmpDouble(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Output format
+static int csv = 0;
+static int nresults = 0;
+
+// Print one result.
+static void printResult(const char* op, const char* pattern, int w, int h,
+                        int reps, double median, double min, double pixels,
+                        const unsigned long counts[NUMCOUNTERS]) {
+  double mbps = (median > 0.0) ? pixels / median / 1e6 : 0.0;   // 1 byte per pixel
+  if (csv) {
+    if (nresults == 0) {
+      printf("op,pattern,width,height,threads,reps,median_s,min_s,mb_per_s");
+      for (int i = 0; i < NUMCOUNTERS; i++)
+        if (InstrName[i] != NULL) printf(",%s", InstrName[i]);
+      printf("\n");
+    }
+    printf("%s,%s,%d,%d,%d,%d,%.9f,%.9f,%.3f", op, pattern, w, h,
+           ImageThreads(), reps, median, min, mbps);
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL) printf(",%lu", counts[i]);
+    printf("\n");
+  } else {
+    printf("%s\n    {\"op\": \"%s\", \"pattern\": \"%s\", \"width\": %d, \"height\": %d, "
+           "\"threads\": %d, \"reps\": %d, \"median_s\": %.9f, \"min_s\": %.9f, "
+           "\"mb_per_s\": %.3f, \"counters\": {",
+           (nresults == 0) ? "" : ",", op, pattern, w, h, ImageThreads(), reps,
+           median, min, mbps);
+    int first = 1;
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL) {
+        printf("%s\"%s\": %lu", first ? "" : ", ", InstrName[i], counts[i]);
+        first = 0;
+      }
+    printf("}}");
+  }
+  nresults++;
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  const char* sizes = "1,4,16";
+  const char* patterns = "random,gradient";
+  const char* oplist = NULL;
+  int reps = 5;
+  int warmup = 1;
+  int threads = 0;
+
+  for (int k = 1; k < argc; k++) {
+    if (argv[k][0] != '-' || argv[k][1] == '\0' || argv[k][2] != '\0' || k + 1 >= argc) {
+      error(1, 0, "Invalid option: %s\n%s", argv[k], USAGE);
+    }
+    const char* value = argv[++k];
+    switch (argv[k-1][1]) {
+      case 's': sizes = value; break;
+      case 'p': patterns = value; break;
+      case 'o': oplist = value; break;
+      case 'r': reps = atoi(value); break;
+      case 'w': warmup = atoi(value); break;
+      case 't': threads = atoi(value); break;
+      case 'F': scratch = value; break;
+      case 'f':
+        if (strcmp(value, "csv") == 0) csv = 1;
+        else if (strcmp(value, "json") != 0) error(1, 0, "Invalid format: %s", value);
+        break;
+      default:
+        error(1, 0, "Invalid option: %s\n%s", argv[k-1], USAGE);
+    }
+  }
+  if (reps < 1 || reps > MAXREPS || warmup < 0 || threads < 0) {
+    error(1, 0, "Invalid number of repetitions, warmups or threads\n%s", USAGE);
+  }
+  for (int i = 0; oplist != NULL && oplist[0] != '\0'; ) {
+    size_t n = strcspn(oplist + i, ",");
+    int known = 0;
+    for (int j = 0; j < nops; j++) {
+      if (strlen(ops[j].name) == n && strncmp(oplist + i, ops[j].name, n) == 0) known = 1;
+    }
+    if (!known) error(1, 0, "Unknown operation in: %s\n%s", oplist, USAGE);
+    i += (int)n;
+    if (oplist[i] == '\0') break;
+    i++;
+  }
+
+  ImageInit();
+  ImageSetThreads(threads);
+
+  if (!csv) printf("{\"benchmarks\": [");
+  double times[MAXREPS];
+  for (const char* s = sizes; *s != '\0'; ) {
+    double mp = atof(s);
+    if (mp <= 0.0 || mp > MAXMP) error(1, 0, "Invalid size: %s", s);
+    s += strcspn(s, ",");
+    if (*s == ',') s++;
+    // 4:3 images with about mp megapixels
+    int w = (int)(sqrt(mp * 1e6 * 4.0 / 3.0) + 0.5);
+    int h = (int)(mp * 1e6 / w + 0.5);
+
+    for (const char* p = patterns; *p != '\0'; ) {
+      char pattern[32];
+      size_t n = strcspn(p, ",");
+      snprintf(pattern, sizeof(pattern), "%.*s", (int)n, p);
+      p += n;
+      if (*p == ',') p++;
+      Image src = synthesize(w, h, pattern);
+      if (src == NULL) error(1, 0, "Unknown pattern: %s", pattern);
+      fprintf(stderr, "Benchmarking %dx%d %s\n", w, h, pattern);
+      // The file operations read the image from the scratch file
+      if (!ImageSave(src, scratch)) {
+        error(2, errno, "Writing %s: %s", scratch, ImageErrMsg());
+      }
+
+      for (int j = 0; j < nops; j++) {
+        if (!inList(oplist, ops[j].name)) continue;
+        // Each operation works on its own copy of the image
+        Image img = ImageCrop(src, 0, 0, w, h);
+        int aw = (w < 64) ? w : 64;
+        int ah = (h < 64) ? h : 64;
+        Image aux = ImageCrop(src, w - aw, h - ah, aw, ah);
+        if (img == NULL || aux == NULL) {
+          error(2, errno, "Copying image: %s", ImageErrMsg());
+        }
+        for (int r = 0; r < warmup; r++) {
+          ops[j].run(img, aux);
+        }
+        unsigned long counts[NUMCOUNTERS];
+        for (int r = 0; r < reps; r++) {
+          InstrReset();
+          double t0 = wall_time();
+          ops[j].run(img, aux);
+          times[r] = wall_time() - t0;
+          InstrTotals(counts);   // all threads
+        }
+        qsort(times, (size_t)reps, sizeof(double), cmpDouble);
+        double median = (reps % 2 == 1) ? times[reps/2]
+                                        : (times[reps/2 - 1] + times[reps/2]) / 2.0;
+        printResult(ops[j].name, pattern, w, h, reps, median, times[0],
+                    ops[j].pixels(img, aux), counts);
+        fflush(stdout);
+        ImageDestroy(&aux);
+        ImageDestroy(&img);
+      }
+      ImageDestroy(&src);
+    }
+  }
+  if (!csv) printf("\n]}\n");
+  remove(scratch);
+  return 0;
+}
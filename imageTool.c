@@ -15,6 +15,13 @@
 #include <errno.h>
 #include "error.h"
 #include <assert.h>
+// POSIX systems have threads and glob patterns (see batch mode).
+#if defined(__unix__) || defined(__APPLE__)
+#define TOOL_POSIX 1
+#include <glob.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#endif
 
 #include "image8bit.h"
 #include "instrumentation.h"
@@ -29,6 +36,8 @@ static const char* USAGE =
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  The buffer grows as needed, and images that no later operation\n"
+    "  can use are released.\n"
     "\n"
     "FILES:\n"
     "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
@@ -36,10 +45,14 @@ static const char* USAGE =
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
+    "  map FILE        Load PGM image file by mapping it into memory\n"
     "  save FILE       Save CURR to PGM file\n"
     "  info            Show information on CURR (size and range)\n"
     "  tic             Reset instrumentation counters and times.\n"
-    "  toc             Print instrumentation counters and times.\n"
+    "  toc             Print instrumentation counters and times (also per operation).\n"
+    "  calibrate       Recalibrate the time unit of instrumentation (caltime)\n"
+    "  threads N       Set number of threads for image operations (0 = automatic)\n"
+    "  lazy ON         Defer operations until their result is needed (1, the default) or not (0)\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
@@ -47,179 +60,1282 @@ static const char* USAGE =
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  rotatecw        Rotate CURR 90º clockwise, creating new image\n"
+    "  rotate180       Rotate CURR 180º, creating new image\n"
+    "  tile SIZE       Set tile size for rotations (0 = automatic)\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
+    "  mirrorip        Mirror CURR left-to-right, in-place\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  view X,Y,W,H    Create a view of a rectangle of CURR (shares pixels, no copy)\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  locatechunk N   Set candidate rows per thread work unit for locate (0 = automatic)\n"
+    "  locateh         same as locate, using a 2D rolling hash\n"
+    "  locateall K     Search the K images before CURR in CURR, print all matching positions\n"
+    "  locatesad       Search PRED in CURR, print position with smallest sum of abs. differences\n"
+    "  locatencc       Search PRED in CURR, print position with highest normalized cross-correlation\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  blurs DX,DY     same as blur, using separable running sums (less memory)\n"
     "\n"              
+    "DEFERRED OPERATIONS:\n"
+    "  neg, thr, bri, rotate, rotatecw, rotate180, mirror, mirrorip and crop\n"
+    "  are only executed when their result is needed (by info, save, locate,\n"
+    "  paste, ..., tic and toc).  The pending chain is then executed at once:\n"
+    "  point operations are fused into a single pass, crops are done first,\n"
+    "  and consecutive rotations and mirrors are combined.\n"
+    "  The time of a whole chain is charged to the operation that needs its\n"
+    "  result.  Use lazy 0 to execute (and time) each operation on its own.\n"
+    "\n"
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
     "\n"
+    "PROFILING:\n"
+    "  imageTool --profile[=FILE.json] [FILE...] [OPERATION [OPERAND...]]\n"
+    "  Time every step of the pipeline (load, each operation, save) and\n"
+    "  count its pixel accesses and other instrumented events.  A summary\n"
+    "  table is printed at exit (and written as JSON to FILE.json, if given).\n"
+    "  Operations are not deferred while profiling, so each step has its own\n"
+    "  time, but a normal run may combine them into fewer passes.\n"
+    "\n"
+    "STREAMING:\n"
+    "  imageTool stream MEMORY FILE [OPERATION...] save FILE\n"
+    "  Process FILE by bands of rows, using about MEMORY bytes for pixels\n"
+    "  (suffixes K, M and G are accepted), so that images larger than the\n"
+    "  available memory can be processed.  Only neg, thr, bri, blur and blurs\n"
+    "  may be used.  The peak memory use is reported at the end.\n"
+    "\n"
+    "BATCH:\n"
+    "  imageTool batch JOBS MEMORY INPUT... -- [OPERATION...]\n"
+    "  Apply the same pipeline to each INPUT, which may be a FILE, a glob\n"
+    "  pattern (quoted) or @MANIFEST, a file with one FILE per line.\n"
+    "  Each %s in the FILE of save is replaced by the name of the input\n"
+    "  (without directory and extension).  Up to JOBS inputs (0 = automatic)\n"
+    "  are processed at once, while their estimated images fit in MEMORY\n"
+    "  (0 = unlimited).  The throughput in images/s is reported at the end.\n"
+    "  With more than one job, threads, tile, locatechunk, tic and toc may not\n"
+    "  be used: they change settings (or counters) shared by all the jobs.\n"
+    "\n"
     ;
 
 static char* errors[] = {
   "Success",
   "Insufficient operands",
   "Insufficient images",
-  "Image buffer is full",
+  "Cannot grow the image buffer",
   "Image8bit failure: %s",
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Operation not supported in streaming mode",
+  "Memory budget too small for this image",
+  "Cannot read manifest file",
+  "Some files failed in batch mode",
+  "Operation not supported in batch mode with several jobs",
 };
 
 
-// This program strives for correctness and robustness.
-// You may want to temporarily comment out operand validation, namely
-// precondition checks, so that you can force precondition violations, and
-// observe the effect of assertions.
+// Number of operands of a point operation (neg, thr, bri),
+// or -1 if arg is not a point operation.
+static int pointOpArity(const char* arg) {
+  if (strcmp(arg, "neg") == 0) return 0;
+  if (strcmp(arg, "thr") == 0) return 1;
+  if (strcmp(arg, "bri") == 0) return 1;
+  return -1;
+}
+
+
+// Peak resident memory of this process, in KB (or -1 if unknown).
+static long peakMemoryKB(void) {
+#if defined(__unix__) || defined(__APPLE__)
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;   // bytes on MacOS
+#else
+    return ru.ru_maxrss;          // KB on Linux
+#endif
+  }
+#endif
+  return -1;
+}
+
+// Parse a number of bytes, with an optional suffix K, M or G.
+// Returns 0 if arg is not valid.
+static int parseMemory(const char* arg, double* bytes) {
+  char unit = '\0';
+  if (sscanf(arg, "%lf%c", bytes, &unit) < 1) return 0;
+  switch (unit) {
+    case '\0': break;
+    case 'K': case 'k': *bytes *= 1024.0; break;
+    case 'M': case 'm': *bytes *= 1024.0*1024.0; break;
+    case 'G': case 'g': *bytes *= 1024.0*1024.0*1024.0; break;
+    default: return 0;
+  }
+  return 1;
+}
+
+// A stage of the pipeline in streaming mode:
+// either a blur or a run of point operations fused into a LUT.
+typedef struct {
+  int blur;     // nonzero for a blur stage
+  int dx, dy;   // blur displacements
+  LUT lut;      // table for point operations
+} Stage;
+
+// Streaming mode: imageTool stream MEMORY FILE [OPERATION...] save FILE
+// The input is processed by bands of rows.  Each band is read together with
+// a halo of rows above and below it, as many as the sum of the dy of all
+// blurs, so that the rows of the band come out exactly as if the whole image
+// had been processed at once.  Blurs use ImageBlurSeparable, whose auxiliary
+// memory is small and is accounted for in the budget.
+// Returns an error code (an index into errors).
+static int streamMain(int ac, char* av[]) {
+  if (ac < 4) return 1;
+
+  // Memory budget
+  double memory;
+  if (!parseMemory(av[2], &memory) || memory <= 0.0) return 5;
+
+  // Parse the pipeline
+  Stage* stages = (Stage*)malloc(ac * sizeof(Stage));
+  if (stages == NULL) return 4;
+  int nstages = 0;
+  int halo = 0;    // sum of dy of all blurs
+  int maxdy = -1;  // largest dy of all blurs
+  const char* outname = NULL;
+  int err = 0;
+  for (int k = 4; k < ac && err == 0; k++) {
+    if (pointOpArity(av[k]) >= 0) {
+      // Consecutive point operations share one LUT stage
+      if (nstages == 0 || stages[nstages-1].blur) {
+        stages[nstages].blur = 0;
+        LUTIdentity(stages[nstages].lut);
+        nstages++;
+      }
+      Stage* st = &stages[nstages-1];
+      if (strcmp(av[k], "neg") == 0) {
+        fprintf(stderr, "Negating\n");
+        LUTNegative(st->lut);
+      } else if (strcmp(av[k], "thr") == 0) {
+        uint8 thr;
+        if (++k >= ac) { err = 1; break; }
+        if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
+        fprintf(stderr, "Thresholding at %d\n", thr);
+        LUTThreshold(st->lut, thr);
+      } else {  // bri
+        double factor;
+        if (++k >= ac) { err = 1; break; }
+        if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
+        fprintf(stderr, "Brightening by %lf\n", factor);
+        LUTBrighten(st->lut, factor);
+      }
+    } else if (strcmp(av[k], "blur") == 0 || strcmp(av[k], "blurs") == 0) {
+      Stage* st = &stages[nstages++];
+      if (++k >= ac) { err = 1; break; }
+      if (sscanf(av[k], "%d,%d", &st->dx, &st->dy) != 2) { err = 5; break; }
+      if (st->dx < 0 || st->dy < 0) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Blur with %dx%d mean filter\n", 2*st->dx+1, 2*st->dy+1);
+      st->blur = 1;
+      halo += st->dy;
+      if (st->dy > maxdy) maxdy = st->dy;
+    } else if (strcmp(av[k], "save") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (k != ac-1) { err = 8; break; }   // save must be the last operation
+      outname = av[k];
+    } else {
+      err = 8;
+    }
+  }
+  if (err == 0 && outname == NULL) err = 1;
+
+  PGMStream in = NULL;
+  PGMStream out = NULL;
+  Image buffer = NULL;
+  int w = 0, h = 0;
+  int bandRows = 0;
+  int nbands = 0;
+  if (err == 0) {
+    InstrReset();
+    fprintf(stderr, "Streaming %s -> %s\n", av[3], outname);
+    in = PGMStreamOpen(av[3]);
+    if (in == NULL) err = 4;
+  }
+  if (err == 0) {
+    w = PGMStreamWidth(in);
+    h = PGMStreamHeight(in);
+    // Rows that fit in the budget, after the auxiliary memory of the blurs
+    double rowBytes = (w > 0) ? w : 1;
+    double aux = (maxdy >= 0) ? (maxdy + 1) * rowBytes + 8.0 * (w + 1) : 0.0;
+    double rows = (memory - aux) / rowBytes - 2.0 * halo;
+    if (rows < 1.0) {
+      err = 9;
+    } else {
+      bandRows = (rows < h) ? (int)rows : h;
+      if (bandRows < 1) bandRows = 1;
+      int bufferRows = (bandRows + 2*halo < h) ? bandRows + 2*halo : h;
+      if (bufferRows < 1) bufferRows = 1;
+      buffer = ImageCreate(w, bufferRows, (uint8)PGMStreamMaxval(in));
+      out = PGMStreamCreate(outname, w, h, (uint8)PGMStreamMaxval(in));
+      if (buffer == NULL || out == NULL) err = 4;
+    }
+  }
+  for (int y0 = 0; err == 0 && y0 < h; y0 += bandRows) {
+    // Band [y0, y1[ is computed from input rows [a, b[
+    int y1 = (y0 + bandRows < h) ? y0 + bandRows : h;
+    int a = (y0 - halo > 0) ? y0 - halo : 0;
+    int b = (y1 + halo < h) ? y1 + halo : h;
+    Image band = ImageView(buffer, 0, 0, w, b - a);
+    Image result = NULL;
+    if (band == NULL || !PGMStreamRead(in, a, band)) {
+      err = 4;
+    } else {
+      for (int i = 0; i < nstages; i++) {
+        if (stages[i].blur) {
+          ImageBlurSeparable(band, stages[i].dx, stages[i].dy);
+        } else {
+          ImageApplyLUT(band, stages[i].lut);
+        }
+      }
+      result = ImageView(band, 0, y0 - a, w, y1 - y0);
+      if (result == NULL || !PGMStreamWrite(out, result)) err = 4;
+    }
+    ImageDestroy(&result);
+    ImageDestroy(&band);
+    nbands++;
+  }
+  if (!PGMStreamClose(&out) && err == 0) err = 4;
+  PGMStreamClose(&in);
+  ImageDestroy(&buffer);
+  free(stages);
+
+  if (err == 0) {
+    printf("# Stream: %dx%d in %d bands of up to %d rows (halo %d)\n", w, h, nbands, bandRows, halo);
+    printf("# Peak memory: %ld KB\n", peakMemoryKB());
+    InstrPrint();
+  }
+  return err;
+}
+
+
+// A step of the pipeline, as recorded in profile mode.
+typedef struct {
+  char label[48];                     // operation and operands
+  double time;                        // cpu time
+  double walltime;                    // wall-clock time
+  unsigned long count[NUMCOUNTERS];   // increments of the counters
+} Step;
+
+// The steps recorded in profile mode.
+typedef struct {
+  Step* steps;
+  int nsteps;     // number of steps recorded
+  int maxsteps;   // capacity of steps
+} Profile;
+
+// Build the label of a step from the arguments av[k0..k1].
+static void stepLabel(Step* s, const char* op, char* av[], int k0, int k1) {
+  int len = snprintf(s->label, sizeof(s->label), "%s", op);
+  // an image file is labelled "load FILE"; other steps start with their name
+  int k = strcmp(op, av[k0]) == 0 ? k0 + 1 : k0;
+  for (; k <= k1 && len < (int)sizeof(s->label); k++)
+    len += snprintf(s->label + len, sizeof(s->label) - len, " %s", av[k]);
+}
+
+// Print the profile of a pipeline: one row per step, with its times and
+// counters, and a total row.  The step that took longest is marked with *.
+// If jsonName is not NULL, the profile is also written to that file as JSON.
+// Returns 0 on success, or 4 if the JSON file could not be written.
+static int printProfile(const Step* steps, int nsteps, const char* jsonName) {
+  Step total = { "total", 0.0, 0.0, {0} };
+  int slowest = -1;
+  for (int s = 0; s < nsteps; s++) {
+    total.time += steps[s].time;
+    total.walltime += steps[s].walltime;
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      total.count[i] += steps[s].count[i];
+    if (slowest < 0 || steps[s].walltime > steps[slowest].walltime)
+      slowest = s;
+  }
+
+  printf("# Profile\n");
+  printf("#%4s  %-30s\t%12s\t%12s\t%6s", "step", "operation", "time", "walltime", "%wall");
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    if (InstrName[i] != NULL) printf("\t%15.15s", InstrName[i]);
+  printf("\n");
+  for (int s = 0; s <= nsteps; s++) {
+    const Step* st = s < nsteps ? &steps[s] : &total;
+    double pct = total.walltime > 0.0 ? 100.0 * st->walltime / total.walltime : 0.0;
+    if (s < nsteps)
+      printf("%c%4d  %-30.30s", s == slowest ? '*' : ' ', s, st->label);
+    else
+      printf("%5s  %-30.30s", "", st->label);
+    printf("\t%12.6f\t%12.6f\t%6.1f", st->time, st->walltime, pct);
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL) printf("\t%15lu", st->count[i]);
+    printf("\n");
+  }
+
+  if (jsonName == NULL) return 0;
+  FILE* f = fopen(jsonName, "w");
+  if (f == NULL) return 4;
+  fprintf(f, "{\n  \"steps\": [");
+  for (int s = 0; s <= nsteps; s++) {
+    const Step* st = s < nsteps ? &steps[s] : &total;
+    if (s == nsteps) fprintf(f, "\n  ],\n  \"total\": ");
+    else fprintf(f, "%s\n    ", s > 0 ? "," : "");
+    fprintf(f, "{\"operation\": \"");
+    for (const char* c = st->label; *c != '\0'; c++) {
+      if (*c == '"' || *c == '\\') fputc('\\', f);
+      fputc(*c, f);
+    }
+    fprintf(f, "\", \"time\": %.6f, \"walltime\": %.6f", st->time, st->walltime);
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL) fprintf(f, ", \"%s\": %lu", InstrName[i], st->count[i]);
+    fprintf(f, "}");
+  }
+  fprintf(f, "\n}\n");
+  return fclose(f) == 0 ? 0 : 4;
+}
+
+
+// The operation graph
 //
-// Also, the program does not test every module function, but you may easily
-// add new operations for that purpose.
+// Operations that transform CURR (neg, thr, bri, rotate, rotatecw, rotate180,
+// mirror, mirrorip and crop) are not executed immediately.  Each one adds a
+// node to a graph, whose edges lead to the node of the input image, and
+// the image buffer holds the nodes.  A node is executed only when its image
+// is actually needed (by save, info, locate, paste, ...), and then the whole
+// chain of deferred operations from the nearest executed image is reduced
+// to a plan of at most one crop, one flip, one rotation and one LUT:
+// point operations are fused, crops are moved ahead of all other operations
+// (so they touch fewer pixels), and rotations and flips are composed (so
+// rotate+rotatecw or mirror+mirror cost nothing).  Intermediate images that
+// are never needed are never created.
 
-int main(int ac, char* av[]) {
-  program_name = av[0];
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+// Kinds of nodes
+enum { NODE_IMAGE, NODE_LUT, NODE_CROP, NODE_ORIENT };
+
+typedef struct node* Node;
+
+struct node {
+  int refs;             // references from the buffer and from other nodes
+  int kind;             // NODE_IMAGE or a deferred operation
+  int width, height;    // size of the resulting image
+  int shared;           // image shares pixels with another image (a view)
+  Image img;            // the resulting image (NULL while deferred)
+  Node in;              // input of the deferred operation
+  LUT lut;              // NODE_LUT: the point transformation
+  int x, y;             // NODE_CROP: top left corner (size is width, height)
+  int flip, turns;      // NODE_ORIENT: mirror if flip, then rotate turns*90º anti-clockwise
+};
+
+// Create a node with one reference.  For a deferred operation, in is its
+// input node, which gets one more reference.  Returns NULL on failure.
+static Node nodeCreate(int kind, Node in, int width, int height) {
+  Node nd = (Node)malloc(sizeof(struct node));
+  if (nd == NULL) return NULL;
+  nd->refs = 1;
+  nd->kind = kind;
+  nd->width = width;
+  nd->height = height;
+  nd->shared = 0;
+  nd->img = NULL;
+  nd->in = in;
+  if (in != NULL) in->refs++;
+  nd->flip = nd->turns = 0;
+  return nd;
+}
+
+// Create a node for an image that is already available.
+// Returns NULL on failure (and img is destroyed).
+static Node nodeFromImage(Image img) {
+  if (img == NULL) return NULL;
+  Node nd = nodeCreate(NODE_IMAGE, NULL, ImageWidth(img), ImageHeight(img));
+  if (nd == NULL) { ImageDestroy(&img); return NULL; }
+  nd->img = img;
+  return nd;
+}
+
+// Drop a reference to node *ndp, destroying it when no references remain.
+// *ndp is set to NULL.
+static void nodeRelease(Node* ndp) {
+  Node nd = *ndp;
+  *ndp = NULL;
+  while (nd != NULL && --nd->refs == 0) {
+    Node in = nd->in;
+    if (nd->img != NULL) ImageDestroy(&nd->img);
+    free(nd);
+    nd = in;
   }
+}
 
-  ImageInit();
+// Check if the rectangle (x,y,w,h) is inside the image of node nd
+// (same test as ImageValidRect, which needs the image itself).
+static int nodeValidRect(Node nd, int x, int y, int w, int h) {
+  return 0 <= x && x < nd->width && 0 <= y && y < nd->height &&
+         0 <= x+w-1 && x+w-1 < nd->width && 0 <= y+h-1 && y+h-1 < nd->height;
+}
+
+// A chain of deferred operations reduced to: crop rectangle (x,y,w,h) of the
+// source, then mirror if flip, then rotate turns*90º anti-clockwise, then lut.
+typedef struct {
+  int x, y, w, h;
+  int flip, turns;
+  int lutIdentity;
+  LUT lut;
+} Plan;
+
+// Add the operation of node nd at the end of plan p.
+static void planAdd(Plan* p, Node nd) {
+  if (nd->kind == NODE_LUT) {
+    // point operations commute with geometric ones, so they are all fused
+    LUTCompose(p->lut, nd->lut);
+    p->lutIdentity = 0;
+  } else if (nd->kind == NODE_ORIENT) {
+    // mirror after rotating by t equals rotating by -t after mirroring
+    if (nd->flip) {
+      p->turns = (4 - p->turns) % 4;
+      p->flip = !p->flip;
+    }
+    p->turns = (p->turns + nd->turns) % 4;
+  } else {  // NODE_CROP
+    // Map the rectangle back through the rotation and the flip,
+    // so that it is cropped from the source.
+    int a = nd->x, b = nd->y, cw = nd->width, ch = nd->height;
+    int W = (p->turns % 2) ? p->h : p->w;   // size after the plan so far
+    int H = (p->turns % 2) ? p->w : p->h;
+    for (int t = 0; t < p->turns; t++) {
+      // one rotation back: (a,b) in a WxH image came from (H-1-b,a)
+      int a1 = H - b - ch, b1 = a;
+      a = a1; b = b1;
+      int c = cw; cw = ch; ch = c;
+      c = W; W = H; H = c;
+    }
+    if (p->flip) a = W - a - cw;
+    p->x += a;
+    p->y += b;
+    p->w = cw;
+    p->h = ch;
+  }
+}
+
+// Get the image of node nd, executing its deferred operations if needed.
+// Returns NULL on failure.
+static Image nodeImage(Node nd) {
+  if (nd->img != NULL) return nd->img;
 
+  // Find the chain of deferred operations from the nearest executed node
+  int len = 0;
+  Node src = nd;
+  while (src->img == NULL) { src = src->in; len++; }
+  Node* chain = (Node*)malloc(len * sizeof(Node));
+  if (chain == NULL) return NULL;
+  // The source image may be transformed in-place (without a copy) if no
+  // other node or buffer entry depends on it or on the intermediate nodes
+  int steal = !src->shared && src->refs == 1;
+  Node m = nd;
+  for (int i = len-1; i >= 0; i--) {
+    chain[i] = m;
+    if (m != nd && m->refs > 1) steal = 0;
+    m = m->in;
+  }
+
+  Plan p = { 0, 0, src->width, src->height, 0, 0, 1, {0} };
+  LUTIdentity(p.lut);
+  for (int i = 0; i < len; i++) planAdd(&p, chain[i]);
+  free(chain);
+  fprintf(stderr, "  Executing %d deferred operations: crop (%d,%d,%d,%d), %sturn %dx90º%s\n",
+          len, p.x, p.y, p.w, p.h, p.flip ? "mirror, " : "", p.turns,
+          p.lutIdentity ? "" : ", LUT");
+
+  Image res;
+  int full = p.x == 0 && p.y == 0 && p.w == src->width && p.h == src->height;
+  if (!p.flip && p.turns == 0) {
+    if (full && steal) {
+      res = src->img;
+      src->img = NULL;
+    } else {
+      res = ImageCrop(src->img, p.x, p.y, p.w, p.h);
+    }
+  } else {
+    Image v = full ? src->img : ImageView(src->img, p.x, p.y, p.w, p.h);
+    if (v == NULL) return NULL;
+    // mirror then rotate by t equals rotate by -t then mirror
+    int t = p.flip ? (4 - p.turns) % 4 : p.turns;
+    switch (t) {
+      case 1: res = ImageRotate(v); break;
+      case 2: res = ImageRotate180(v); break;
+      case 3: res = ImageRotateClockwise(v); break;
+      default: res = ImageMirror(v); break;
+    }
+    if (!full) ImageDestroy(&v);
+    if (res != NULL && p.flip && t != 0) ImageMirrorInPlace(res);
+  }
+  if (res == NULL) return NULL;
+  if (!p.lutIdentity) ImageApplyLUT(res, p.lut);
+
+  // The inputs are no longer needed by this node
+  nd->img = res;
+  nd->kind = NODE_IMAGE;
+  nodeRelease(&nd->in);
+  return res;
+}
+
+// Apply a point transformation to the node in buffer entry *ndp:
+// deferred in a new node, or in-place if its pixels are shared.
+// Returns 0 on failure.
+static int nodePoint(Node* ndp, const LUT lut) {
+  if ((*ndp)->shared) {
+    ImageApplyLUT((*ndp)->img, lut);
+    return 1;
+  }
+  Node nd = nodeCreate(NODE_LUT, *ndp, (*ndp)->width, (*ndp)->height);
+  if (nd == NULL) return 0;
+  memcpy(nd->lut, lut, sizeof(LUT));
+  nodeRelease(ndp);
+  *ndp = nd;
+  return 1;
+}
+
+// Create a node that mirrors (if flip) and then rotates the image of node in
+// by turns*90º anti-clockwise.  Returns NULL on failure.
+static Node nodeOrient(Node in, int flip, int turns) {
+  int swap = turns % 2;
+  Node nd = nodeCreate(NODE_ORIENT, in, swap ? in->height : in->width,
+                                        swap ? in->width : in->height);
+  if (nd == NULL) return NULL;
+  nd->flip = flip;
+  nd->turns = turns;
+  return nd;
+}
+
+
+// The image store
+//
+// The images are kept in a buffer that grows as needed.  Operations refer
+// to the last images only (CURR, PRED, or the K+1 last for locateall), so
+// before each operation the pipeline is scanned ahead to find how many of
+// the last images may still be used, and the others are released.  As the
+// nodes of the operation graph are reference counted, an image released
+// from the buffer survives while a deferred operation still needs it.
+
+// Arguments of the operations, as seen by the scan ahead
+typedef struct {
+  const char* name;
+  int operands;   // number of operands
+  int uses;       // number of last images used
+  int creates;    // number of images created
+} OpInfo;
+
+static const OpInfo opInfo[] = {
+  { "info", 0, 1, 0 },       { "tic", 0, 1, 0 },        { "toc", 0, 1, 0 },
+  { "lazy", 1, 1, 0 },       { "calibrate", 0, 0, 0 },  { "threads", 1, 0, 0 },
+  { "tile", 1, 0, 0 },       { "locatechunk", 1, 0, 0 },
+  { "neg", 0, 1, 0 },        { "thr", 1, 1, 0 },        { "bri", 1, 1, 0 },
+  { "create", 1, 0, 1 },     { "map", 1, 0, 1 },
+  { "rotate", 0, 1, 1 },     { "rotatecw", 0, 1, 1 },   { "rotate180", 0, 1, 1 },
+  { "mirror", 0, 1, 1 },     { "mirrorip", 0, 1, 0 },
+  { "crop", 1, 1, 1 },       { "view", 1, 1, 1 },
+  { "paste", 1, 2, 0 },      { "blend", 1, 2, 0 },
+  { "locate", 0, 2, 0 },     { "locateh", 0, 2, 0 },    { "locateall", 1, -1, 0 },
+  { "locatesad", 0, 2, 0 },  { "locatencc", 0, 2, 0 },
+  { "blur", 1, 1, 0 },       { "blurs", 1, 1, 0 },      { "save", 1, 1, 0 },
+  { NULL, 0, 0, 1 },         // anything else is an image file to load
+};
+
+// Compute, for each argument av[k] that starts an operation, the number of
+// last images that the operations from av[k] on may use: live[k].
+// Returns a new array of ac+1 entries (or NULL on failure).
+static int* storeLive(int ac, char* av[]) {
+  int* live = (int*)malloc((ac + 1) * sizeof(int));
+  const OpInfo** info = (const OpInfo**)malloc((ac + 1) * sizeof(OpInfo*));
+  if (live == NULL || info == NULL) { free(live); free(info); return NULL; }
+  // find the operations
+  for (int k = 1; k <= ac; k++) info[k] = NULL;
+  for (int k = 1; k < ac; ) {
+    const OpInfo* op = opInfo;
+    while (op->name != NULL && strcmp(op->name, av[k]) != 0) op++;
+    info[k] = op;
+    k += 1 + op->operands;
+  }
+  // and go backwards: images created by an operation do not count as live before it
+  live[ac] = 0;
+  for (int k = ac - 1; k >= 1; k--) {
+    live[k] = live[k+1];
+    if (info[k] == NULL) continue;   // an operand
+    int uses = info[k]->uses;
+    int K;
+    if (uses < 0) {  // locateall K (keep everything if K is invalid)
+      uses = (k+1 < ac && sscanf(av[k+1], "%d", &K) == 1 && K >= 1) ? K + 1 : ac;
+    }
+    live[k] -= info[k]->creates;
+    if (live[k] < uses) live[k] = uses;
+  }
+  free(info);
+  return live;
+}
+
+// Run the pipeline of FILES and OPERATIONS av[1..ac-1] (the normal mode).
+// If prof is not NULL, the time and counters of each step are recorded in it.
+// Returns an error code (an index into errors).
+static int pipeline(int ac, char* av[], Profile* prof) {
   int err = 0;
   int x, y, w, h;
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
+  // The image buffer (of nodes of the operation graph)
+  Node* img = NULL;   // the images (NULL when released)
+  int cap = 0;        // buffer capacity
   int n = 0;          // number of images created
+  int released = 0;   // images [0, released[ have been released
+  int* live = storeLive(ac, av);
+  if (live == NULL) return 3;
+  int lazy = (prof == NULL);   // defer operations (or execute each immediately)
+  Image im;           // an executed image
 
   int k = 1;
   while (k < ac) {
+    // Each operation is timed separately (shown by toc), except tic and toc
+    const char* op = av[k];
+    InstrOpStart();
+    int k0 = k;
+    double t0 = cpu_time();
+    double w0 = wall_time();
+    unsigned long c0[NUMCOUNTERS];
+    if (prof != NULL) InstrTotals(c0);
+    // Make room for a new image, and release those that are no longer needed
+    if (n == cap) {
+      cap = cap == 0 ? 16 : 2*cap;
+      Node* more = (Node*)realloc(img, cap * sizeof(Node));
+      if (more == NULL) { err = 3; break; }
+      img = more;
+    }
+    while (released < n - live[k]) {
+      if (img[released] != NULL) fprintf(stderr, "Releasing I%d\n", released);
+      nodeRelease(&img[released++]);
+    }
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Info on I%d\n", n-1);
+      if ((im = nodeImage(img[n-1])) == NULL) { err = 4; break; }
       uint8 min, max;
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
-      uint8 maxval = ImageMaxval(img[n-1]);
-      ImageStats(img[n-1], &min, &max);
+      w = ImageWidth(im);
+      h = ImageHeight(im);
+      uint8 maxval = ImageMaxval(im);
+      ImageStats(im, &min, &max);
       printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
       printf("# Gray level range: [%hhu, %hhu]\n", min, max);
     } else if (strcmp(av[k], "tic") == 0) {
+      // pending operations are executed first, so they are not counted
+      if (n > 0 && nodeImage(img[n-1]) == NULL) { err = 4; break; }
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
+      if (n > 0 && nodeImage(img[n-1]) == NULL) { err = 4; break; }
       InstrPrint();
+    } else if (strcmp(av[k], "lazy") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (sscanf(av[k], "%d", &lazy) != 1) { err = 5; break; }
+      fprintf(stderr, "%s operations\n", lazy ? "Deferring" : "Not deferring");
+      if (!lazy && n > 0 && nodeImage(img[n-1]) == NULL) { err = 4; break; }
+    } else if (strcmp(av[k], "calibrate") == 0) {
+      fprintf(stderr, "Calibrating instrumentation\n");
+      InstrCalibrate();
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
+      LUT lut;
+      LUTIdentity(lut);
+      LUTNegative(lut);
+      if (!nodePoint(&img[n-1], lut)) { err = 4; break; }
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
       fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
+      LUT lut;
+      LUTIdentity(lut);
+      LUTThreshold(lut, thr);
+      if (!nodePoint(&img[n-1], lut)) { err = 4; break; }
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
       fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      if (factor < 0.0) { err = 5; break; }   // precondition check!
+      LUT lut;
+      LUTIdentity(lut);
+      LUTBrighten(lut, factor);
+      if (!nodePoint(&img[n-1], lut)) { err = 4; break; }
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
       if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
       fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
+      img[n] = nodeFromImage(ImageCreate(w, h, PixMax));
       if (img[n] == NULL) { err = 4; break; }
       n++;
     } else if (strcmp(av[k], "rotate") == 0) {
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
       fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
-      img[n] = ImageRotate(img[n-1]);
+      img[n] = nodeOrient(img[n-1], 0, 1);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "rotatecw") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Rotating I%d clockwise -> I%d\n", n-1, n);
+      img[n] = nodeOrient(img[n-1], 0, 3);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "rotate180") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Rotating I%d by 180º -> I%d\n", n-1, n);
+      img[n] = nodeOrient(img[n-1], 0, 2);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "threads") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int threads;
+      if (sscanf(av[k], "%d", &threads) != 1 || threads < 0) { err = 5; break; }
+      ImageSetThreads(threads);
+      fprintf(stderr, "Using %d threads\n", ImageThreads());
+    } else if (strcmp(av[k], "tile") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int tile;
+      if (sscanf(av[k], "%d", &tile) != 1 || tile < 0) { err = 5; break; }
+      fprintf(stderr, "Setting tile size to %d\n", tile);
+      ImageSetTileSize(tile);
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
       fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
-      img[n] = ImageMirror(img[n-1]);
+      img[n] = nodeOrient(img[n-1], 1, 0);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "mirrorip") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Mirroring I%d in-place\n", n-1);
+      if (img[n-1]->shared) {
+        ImageMirrorInPlace(img[n-1]->img);
+      } else {
+        Node nd = nodeOrient(img[n-1], 1, 0);
+        if (nd == NULL) { err = 4; break; }
+        nodeRelease(&img[n-1]);
+        img[n-1] = nd;
+      }
     } else if (strcmp(av[k], "crop") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
+      if (!nodeValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
       fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
-      img[n] = ImageCrop(img[n-1], x, y, w, h);
+      img[n] = nodeCreate(NODE_CROP, img[n-1], w, h);
       if (img[n] == NULL) { err = 4; break; }
+      img[n]->x = x;
+      img[n]->y = y;
+      n++;
+    } else if (strcmp(av[k], "view") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      if (!nodeValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Viewing I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+      if ((im = nodeImage(img[n-1])) == NULL) { err = 4; break; }
+      img[n] = nodeFromImage(ImageView(im, x, y, w, h));
+      if (img[n] == NULL) { err = 4; break; }
+      // in-place operations on either one must change both
+      img[n-1]->shared = img[n]->shared = 1;
       n++;
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
       if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+      w = img[n-2]->width;
+      h = img[n-2]->height;
+      if (!nodeValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
       fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
-      ImagePaste(img[n-1], x, y, img[n-2]);
+      if ((im = nodeImage(img[n-1])) == NULL || nodeImage(img[n-2]) == NULL) { err = 4; break; }
+      ImagePaste(im, x, y, img[n-2]->img);
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
       double alpha;
       if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+      w = img[n-2]->width;
+      h = img[n-2]->height;
+      if (!nodeValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
       fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
-      ImageBlend(img[n-1], x, y, img[n-2], alpha);
+      if ((im = nodeImage(img[n-1])) == NULL || nodeImage(img[n-2]) == NULL) { err = 4; break; }
+      ImageBlend(im, x, y, img[n-2]->img, alpha);
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) { err = 2; break; }
       fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
-      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
+      if ((im = nodeImage(img[n-1])) == NULL || nodeImage(img[n-2]) == NULL) { err = 4; break; }
+      if (ImageLocateSubImage(im, &x, &y, img[n-2]->img)) {
         printf("# FOUND (%d,%d)\n", x, y);
       } else {
         printf("# NOTFOUND\n");
       }
+    } else if (strcmp(av[k], "locatechunk") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int rows;
+      if (sscanf(av[k], "%d", &rows) != 1 || rows < 0) { err = 5; break; }
+      fprintf(stderr, "Setting locate chunk to %d rows\n", rows);
+      ImageSetLocateChunk(rows);
+    } else if (strcmp(av[k], "locateh") == 0) {
+      if (n < 2) { err = 2; break; }
+      fprintf(stderr, "Locating I%d in I%d (hashed)\n", n-2, n-1);
+      if ((im = nodeImage(img[n-1])) == NULL || nodeImage(img[n-2]) == NULL) { err = 4; break; }
+      if (ImageLocateSubImageHashed(im, &x, &y, img[n-2]->img)) {
+        printf("# FOUND (%d,%d)\n", x, y);
+      } else {
+        printf("# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "locateall") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int K;
+      if (sscanf(av[k], "%d", &K) != 1 || K < 1) { err = 5; break; }
+      if (n < K+1) { err = 2; break; }
+      fprintf(stderr, "Locating I%d..I%d in I%d\n", n-1-K, n-2, n-1);
+      Image* subimgs = (Image*)malloc((K + 1) * sizeof(Image));
+      if (subimgs == NULL) { err = 3; break; }
+      for (int i = K; i >= 0; i--) {
+        if ((subimgs[i] = nodeImage(img[n-1-K + i])) == NULL) { err = 4; break; }
+      }
+      ImageMatch* matches = NULL;
+      int nmatches = err == 0 ? ImageLocateAll(subimgs[K], K, subimgs, &matches) : 0;
+      free(subimgs);
+      if (err != 0) break;
+      if (nmatches < 0) { err = 4; break; }
+      for (int i = 0; i < nmatches; i++) {
+        printf("# FOUND I%d (%d,%d)\n", n-1-K + matches[i].index, matches[i].x, matches[i].y);
+      }
+      printf("# MATCHES %d\n", nmatches);
+      free(matches);
+    } else if (strcmp(av[k], "locatesad") == 0) {
+      if (n < 2) { err = 2; break; }
+      fprintf(stderr, "Locating I%d in I%d (SAD)\n", n-2, n-1);
+      if ((im = nodeImage(img[n-1])) == NULL || nodeImage(img[n-2]) == NULL) { err = 4; break; }
+      uint64_t sad;
+      if (ImageLocateBestSAD(im, &x, &y, img[n-2]->img, UINT64_MAX, &sad)) {
+        printf("# BEST (%d,%d) SAD %llu\n", x, y, (unsigned long long)sad);
+      } else {
+        printf("# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "locatencc") == 0) {
+      if (n < 2) { err = 2; break; }
+      fprintf(stderr, "Locating I%d in I%d (NCC)\n", n-2, n-1);
+      if ((im = nodeImage(img[n-1])) == NULL || nodeImage(img[n-2]) == NULL) { err = 4; break; }
+      double ncc;
+      if (ImageLocateBestNCC(im, &x, &y, img[n-2]->img, -1.0, &ncc)) {
+        printf("# BEST (%d,%d) NCC %.6f\n", x, y, ncc);
+      } else {
+        printf("# NOTFOUND\n");
+      }
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       int dx; int dy;
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
       fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
+      if ((im = nodeImage(img[n-1])) == NULL) { err = 4; break; }
+      ImageBlur(im, dx, dy);
+    } else if (strcmp(av[k], "blurs") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      fprintf(stderr, "Separable blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
+      if ((im = nodeImage(img[n-1])) == NULL) { err = 4; break; }
+      ImageBlurSeparable(im, dx, dy);
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      if ((im = nodeImage(img[n-1])) == NULL) { err = 4; break; }
+      if (ImageSave(im, av[k]) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "map") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      fprintf(stderr, "Mapping %s -> I%d\n", av[k], n);
+      img[n] = nodeFromImage(ImageLoadMapped(av[k]));
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else {  // image file
-      if (n >= N) { err = 3; break; }
       fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
+      op = "load";
+      img[n] = nodeFromImage(ImageLoad(av[k]));
       if (img[n] == NULL) { err = 4; break; }
       n++;
     }
+    // Without deferral, CURR is executed by the operation that produces it
+    if (!lazy && n > 0 && nodeImage(img[n-1]) == NULL) { err = 4; break; }
+    if (strcmp(op, "tic") != 0 && strcmp(op, "toc") != 0) InstrOpStop(op);
+    if (prof != NULL) {
+      if (prof->nsteps == prof->maxsteps) {
+        prof->maxsteps = prof->maxsteps == 0 ? 16 : 2*prof->maxsteps;
+        Step* more = realloc(prof->steps, prof->maxsteps * sizeof(Step));
+        if (more == NULL) { err = 4; break; }
+        prof->steps = more;
+      }
+      Step* s = &prof->steps[prof->nsteps++];
+      stepLabel(s, op, av, k0, k);
+      s->time = cpu_time() - t0;
+      s->walltime = wall_time() - w0;
+      unsigned long c1[NUMCOUNTERS];
+      InstrTotals(c1);
+      for (int i = 0; i < NUMCOUNTERS; i++)  // tic resets the counters
+        s->count[i] = c1[i] >= c0[i] ? c1[i] - c0[i] : c1[i];
+    }
     k++;
   }
   
-  // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
+  // Destroy remaining images (deferred operations are simply dropped)
+  while (n > released) {
+    nodeRelease(&img[--n]);
+  }
+  free(img);
+  free(live);
+  return err;
+}
+
+
+// Batch mode: imageTool batch JOBS MEMORY INPUT... -- [OPERATION...]
+// The same pipeline is applied to every input, by JOBS workers that each
+// take the next input in turn.  Before loading an input, a worker reserves
+// an estimate of the memory its pipeline needs (the pixels of the input
+// times the number of images it may create, plus one) and waits while that
+// would take the images in flight above MEMORY.  An input that does not fit
+// on its own is processed when no other input is in flight.
+
+// Inputs and pipeline shared by the workers of batch mode
+typedef struct {
+  char** inputs;        // input file names
+  int ninputs;
+  int capacity;         // capacity of inputs
+  char** ops;           // the pipeline: arguments of the operations
+  int nops;
+  int copies;           // images each pipeline may create, besides the input
+  double budget;        // bytes for the images in flight (0 = unlimited)
+  int next;             // next input to process
+  int failed;           // number of inputs that failed
+  double inflight;      // bytes reserved by inputs in flight
+#ifdef TOOL_POSIX
+  pthread_mutex_t lock;
+  pthread_cond_t freed; // signaled when memory is released
+#endif
+} Batch;
+
+// Operations that create an image, or need a buffer as large as one
+static const char* batchCopyOps[] = {
+  "rotate", "rotatecw", "rotate180", "mirror", "crop", "blur", "blurs", NULL
+};
+
+// Operations that change settings shared by all images (ImageSetThreads,
+// ...) or the instrumentation counters: concurrent jobs would race on them.
+static const char* batchGlobalOps[] = {
+  "threads", "tile", "locatechunk", "tic", "toc", NULL
+};
+
+// Synchronization of the workers (nothing to do without threads).
+static void batchLock(Batch* b) {
+#ifdef TOOL_POSIX
+  pthread_mutex_lock(&b->lock);
+#endif
+}
+
+static void batchUnlock(Batch* b) {
+#ifdef TOOL_POSIX
+  pthread_mutex_unlock(&b->lock);
+#endif
+}
+
+// Reserve memory bytes for an input, waiting while they do not fit.
+static void batchReserve(Batch* b, double memory) {
+  batchLock(b);
+#ifdef TOOL_POSIX
+  while (b->budget > 0.0 && b->inflight > 0.0 && b->inflight + memory > b->budget) {
+    pthread_cond_wait(&b->freed, &b->lock);
+  }
+#endif
+  b->inflight += memory;
+  batchUnlock(b);
+}
+
+// Release the memory reserved for an input, and count it if it failed.
+static void batchRelease(Batch* b, double memory, int failed) {
+  batchLock(b);
+  b->inflight -= memory;
+  b->failed += failed;
+#ifdef TOOL_POSIX
+  pthread_cond_broadcast(&b->freed);
+#endif
+  batchUnlock(b);
+}
+
+// Add a file name to the inputs of batch b.  Returns 0 on failure.
+static int batchAdd(Batch* b, const char* name) {
+  if (b->ninputs == b->capacity) {
+    b->capacity = b->capacity == 0 ? 64 : 2*b->capacity;
+    char** more = (char**)realloc(b->inputs, b->capacity * sizeof(char*));
+    if (more == NULL) return 0;
+    b->inputs = more;
+  }
+  b->inputs[b->ninputs] = strdup(name);
+  return b->inputs[b->ninputs++] != NULL;
+}
+
+// Add the inputs given by arg to batch b: the file names listed in
+// manifest file MANIFEST if arg is @MANIFEST (one per line; empty lines
+// and lines starting with # are ignored), the files that match arg if it is
+// a glob pattern, or else arg itself.
+// Returns an error code (an index into errors).
+static int batchInputs(Batch* b, const char* arg) {
+  if (arg[0] == '@') {
+    FILE* f = fopen(arg + 1, "r");
+    if (f == NULL) return 10;
+    char line[4096];
+    int err = 0;
+    while (err == 0 && fgets(line, sizeof(line), f) != NULL) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] == '\0' || line[0] == '#') continue;
+      if (!batchAdd(b, line)) err = 4;
+    }
+    fclose(f);
+    return err;
+  }
+#ifdef TOOL_POSIX
+  if (strpbrk(arg, "*?[") != NULL) {
+    glob_t g;
+    int r = glob(arg, 0, NULL, &g);
+    if (r == GLOB_NOMATCH) return 0;
+    if (r != 0) return 4;
+    int err = 0;
+    for (size_t i = 0; i < g.gl_pathc && err == 0; i++) {
+      if (!batchAdd(b, g.gl_pathv[i])) err = 4;
+    }
+    globfree(&g);
+    return err;
+  }
+#endif
+  return batchAdd(b, arg) ? 0 : 4;
+}
+
+// Replace each %s in pattern by the base name of file name input (without
+// directory and extension), giving the name of an output file.
+// Returns a new string (or NULL on failure), to be freed by the caller.
+static char* batchOutput(const char* pattern, const char* input) {
+  const char* base = strrchr(input, '/');
+  base = (base == NULL) ? input : base + 1;
+  const char* dot = strrchr(base, '.');
+  size_t baselen = (dot == NULL || dot == base) ? strlen(base) : (size_t)(dot - base);
+  size_t len = strlen(pattern) + 1;
+  for (const char* p = strstr(pattern, "%s"); p != NULL; p = strstr(p + 2, "%s")) {
+    len += baselen;
+  }
+  char* out = (char*)malloc(len);
+  if (out == NULL) return NULL;
+  char* o = out;
+  for (const char* p = pattern; *p != '\0'; ) {
+    if (p[0] == '%' && p[1] == 's') {
+      memcpy(o, base, baselen);
+      o += baselen;
+      p += 2;
+    } else {
+      *o++ = *p++;
+    }
+  }
+  *o = '\0';
+  return out;
+}
+
+// Apply the pipeline of batch b to input i.
+// Returns an error code (an index into errors).
+static int batchRun(Batch* b, int i) {
+  // the arguments of pipeline: program, input and operations,
+  // with the files to save named after the input
+  char** av = (char**)malloc((b->nops + 2) * sizeof(char*));
+  if (av == NULL) return 4;
+  av[0] = program_name;
+  av[1] = b->inputs[i];
+  int err = 0;
+  int k;
+  for (k = 0; k < b->nops && err == 0; k++) {
+    if (k > 0 && strcmp(b->ops[k-1], "save") == 0) {
+      av[k+2] = batchOutput(b->ops[k], b->inputs[i]);
+      if (av[k+2] == NULL) err = 4;
+    } else {
+      av[k+2] = b->ops[k];
+    }
+  }
+  if (err == 0) err = pipeline(b->nops + 2, av, NULL);
+  for (int j = 1; j < k; j++) {
+    if (strcmp(b->ops[j-1], "save") == 0) free(av[j+2]);
+  }
+  free(av);
+  return err;
+}
+
+// Process the inputs of batch b, one at a time, until there are no more.
+static void* batchWorker(void* arg) {
+  Batch* b = (Batch*)arg;
+  for (;;) {
+    batchLock(b);
+    int i = b->next++;
+    batchUnlock(b);
+    if (i >= b->ninputs) break;
+
+    // estimate the memory from the size in the header (0 if unreadable)
+    double memory = 0.0;
+    PGMStream ps = PGMStreamOpen(b->inputs[i]);
+    if (ps != NULL) {
+      memory = (double)PGMStreamWidth(ps) * PGMStreamHeight(ps) * (1 + b->copies);
+      PGMStreamClose(&ps);
+    }
+    batchReserve(b, memory);
+    int err = batchRun(b, i);
+    if (err != 0) {
+      fprintf(stderr, "%s: ", b->inputs[i]);
+      fprintf(stderr, errors[err], ImageErrMsg());
+      fprintf(stderr, "\n");
+    }
+    batchRelease(b, memory, err != 0);
+  }
+  return NULL;
+}
+
+// Returns an error code (an index into errors).
+static int batchMain(int ac, char* av[]) {
+  if (ac < 5) return 1;
+
+  int jobs;
+  if (sscanf(av[2], "%d", &jobs) != 1 || jobs < 0) return 5;
+  Batch b;
+  memset(&b, 0, sizeof(b));
+  if (!parseMemory(av[3], &b.budget) || b.budget < 0.0) return 5;
+
+  // Inputs up to --, operations after it
+  int sep = 4;
+  while (sep < ac && strcmp(av[sep], "--") != 0) sep++;
+  int err = 0;
+  for (int k = 4; k < sep && err == 0; k++) {
+    err = batchInputs(&b, av[k]);
+  }
+  if (sep < ac) {
+    b.ops = av + sep + 1;
+    b.nops = ac - sep - 1;
+  }
+  for (int k = 0; k < b.nops; k++) {
+    for (int c = 0; batchCopyOps[c] != NULL; c++) {
+      if (strcmp(b.ops[k], batchCopyOps[c]) == 0) b.copies++;
+    }
+  }
+
+  if (jobs == 0) jobs = ImageThreads();
+  if (jobs > b.ninputs) jobs = b.ninputs;
+  for (int k = 0; k < b.nops && jobs > 1 && err == 0; k++) {
+    for (int c = 0; batchGlobalOps[c] != NULL; c++) {
+      if (strcmp(b.ops[k], batchGlobalOps[c]) == 0) err = 12;
+    }
+  }
+#ifdef TOOL_POSIX
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.freed, NULL);
+  // Inputs are processed in parallel, so each operation uses one thread
+  if (jobs > 1) ImageSetThreads(1);
+  pthread_t* workers = (pthread_t*)malloc((jobs > 1 ? jobs - 1 : 1) * sizeof(pthread_t));
+  if (workers == NULL) err = 4;
+#else
+  jobs = 1;
+#endif
+
+  double t0 = wall_time();
+  if (err == 0) {
+#ifdef TOOL_POSIX
+    int started = 0;
+    while (started < jobs - 1 &&
+           pthread_create(&workers[started], NULL, batchWorker, &b) == 0) {
+      started++;
+    }
+    batchWorker(&b);
+    for (int t = 0; t < started; t++) {
+      pthread_join(workers[t], NULL);
+    }
+    jobs = started + 1;
+#else
+    batchWorker(&b);
+#endif
+    double elapsed = wall_time() - t0;
+    printf("# Batch: %d images, %d failed, %d jobs\n", b.ninputs, b.failed, jobs);
+    printf("# Time: %.3f s, %.1f images/s\n", elapsed,
+           elapsed > 0.0 ? (b.ninputs - b.failed) / elapsed : 0.0);
+    printf("# Peak memory: %ld KB\n", peakMemoryKB());
+    if (b.failed > 0) err = 11;
+  }
+
+#ifdef TOOL_POSIX
+  free(workers);
+  pthread_cond_destroy(&b.freed);
+  pthread_mutex_destroy(&b.lock);
+#endif
+  for (int i = 0; i < b.ninputs; i++) {
+    free(b.inputs[i]);
+  }
+  free(b.inputs);
+  return err;
+}
+
+
+// This program strives for correctness and robustness.
+// You may want to temporarily comment out operand validation, namely
+// precondition checks, so that you can force precondition violations, and
+// observe the effect of assertions.
+//
+// Also, the program does not test every module function, but you may easily
+// add new operations for that purpose.
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+
+  // Profile mode: record the time and counters of every step
+  int profile = 0;
+  const char* profileJSON = NULL;
+  if (strncmp(av[1], "--profile", 9) == 0 && (av[1][9] == '\0' || av[1][9] == '=')) {
+    profile = 1;
+    if (av[1][9] == '=') profileJSON = av[1] + 10;
+    av[1] = av[0];  // drop the option
+    av++; ac--;
+  }
+
+  if (ac > 1 && strcmp(av[1], "stream") == 0) {
+    int err = streamMain(ac, av);
+    error(err, errno, errors[err], ImageErrMsg());
+    return 0;
+  }
+
+  if (ac > 1 && strcmp(av[1], "batch") == 0) {
+    int err = batchMain(ac, av);
+    error(err, errno, errors[err], ImageErrMsg());
+    return 0;
+  }
+
+  Profile prof = { NULL, 0, 0 };
+  int err = pipeline(ac, av, profile ? &prof : NULL);
+
+  if (profile) {
+    int perr = printProfile(prof.steps, prof.nsteps, profileJSON);
+    if (err == 0) err = perr;
+    free(prof.steps);
   }
 
   error(err, errno, errors[err], ImageErrMsg());
@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: measure CTU now (else, done when needed)
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,14 +18,24 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// To see how time is distributed among the parts of a program:
+/// InstrOpStart();
+/// ...
+/// InstrOpStop("part1");  // InstrPrint shows the times of each part
 
 #include "instrumentation.h"
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-/// Cpu time in seconds
+/// Cpu time in seconds (of all threads of the process)
 double cpu_time(void) ; ///
 
+/// Wall-clock (elapsed real) time in seconds
+double wall_time(void) ; ///
+
 #if defined(__linux__) || defined(__APPLE__)
 
 //
@@ -42,6 +52,14 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -66,10 +84,142 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+double wall_time(void) {
+  return cpu_time();  // cpu_time() above already measures elapsed time
+}
+
+#endif
+
+// Blocks of counters of all threads, in a list.
+// New blocks are pushed at the head, atomically; blocks are never freed.
+struct instrBlock {
+  unsigned long count[NUMCOUNTERS];
+  struct instrBlock* next;
+};
+static _Atomic(struct instrBlock*) instrBlocks = NULL;
+
+// Used if a block cannot be allocated (shared, so counts may be lost)
+static struct instrBlock instrSpare;
+
+/// Block of counters of the calling thread (NULL until first used).
+_Thread_local unsigned long* InstrBlock = NULL;  ///extern
+
+/// Create the block of counters of the calling thread.
+unsigned long* InstrNewBlock(void) { ///
+  struct instrBlock* b = (struct instrBlock*)calloc(1, sizeof(*b));
+  if (b == NULL) {
+    InstrBlock = instrSpare.count;
+    return InstrBlock;
+  }
+  b->next = atomic_load(&instrBlocks);
+  while (!atomic_compare_exchange_weak(&instrBlocks, &b->next, b)) {
+  }
+  InstrBlock = b->count;
+  return InstrBlock;
+}
+
+/// Names of the hardware events:
+const char* InstrEventName[NUMEVENTS] = {
+  "cycles", "instructions", "cache-misses", "branch-misses"
+};  ///extern
+
+// File descriptors of the hardware events (-1 if not available)
+static int instrEventFd[NUMEVENTS] = {-1, -1, -1, -1};
+
+// Number of hardware events available (-1 if not yet opened)
+static int instrNumEvents = -1;
+
+#ifdef __linux__
+
+//
+// GNU/Linux code to count hardware events
+//
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Open the hardware events for the calling thread and the threads it
+// creates afterwards (inherit): reading an event gives the sum over all of
+// them, so the work done by worker threads is counted too.  (Inherited
+// events cannot be read as a group, so each one is read on its own.)
+static void instrOpenEvents(void) {
+  static const unsigned long long config[NUMEVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+  };
+  instrNumEvents = 0;
+  const char* env = getenv("INSTR_PERF");
+  if (env != NULL && strcmp(env, "0") == 0) return;
+  int errsave = errno;  // failing to open events is not an error of the caller
+  for (int i = 0; i < NUMEVENTS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config[i];
+    attr.exclude_kernel = 1;  // allowed with perf_event_paranoid <= 2
+    attr.exclude_hv = 1;
+    attr.inherit = 1;
+    // With more events than hardware counters, the kernel multiplexes them:
+    // the times enabled and running are used to scale the counts.
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    instrEventFd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (instrEventFd[i] >= 0) instrNumEvents++;
+  }
+  errno = errsave;
+}
+
+// Read the current (scaled) count of each event (0 if not available).
+static void instrReadEvents(double events[NUMEVENTS]) {
+  for (int i = 0; i < NUMEVENTS; i++) {
+    unsigned long long v[3];  // value, time enabled, time running
+    events[i] = 0.0;
+    if (instrEventFd[i] >= 0 && read(instrEventFd[i], v, sizeof(v)) == sizeof(v) && v[2] > 0)
+      events[i] = (double)v[0] * ((double)v[1] / (double)v[2]);
+  }
+}
+
+#else
+
+static void instrOpenEvents(void) {
+  instrNumEvents = 0;
+}
+
+static void instrReadEvents(double events[NUMEVENTS]) {
+  for (int i = 0; i < NUMEVENTS; i++)
+    events[i] = 0.0;
+}
+
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Number of hardware events available (0 if none).
+int InstrEvents(void) { ///
+  if (instrNumEvents < 0) instrOpenEvents();
+  return instrNumEvents;
+}
+
+// Event counts read on previous reset
+static double instrEvents0[NUMEVENTS];
+
+// Print the header (if header) or the values of the events in ev,
+// followed by IPC and MPKI.
+static void instrPrintEvents(const double ev[NUMEVENTS], int header) {
+  for (int i = 0; i < NUMEVENTS; i++)
+    if (instrEventFd[i] >= 0) {
+      if (header) printf("\t%15.15s", InstrEventName[i]);
+      else printf("\t%15.0f", ev[i]);
+    }
+  if (instrEventFd[0] >= 0 && instrEventFd[1] >= 0) {
+    if (header) printf("\t%15.15s", "IPC");
+    else printf("\t%15.3f", (ev[0] > 0.0) ? ev[1] / ev[0] : 0.0);
+  }
+  if (instrEventFd[1] >= 0 && instrEventFd[2] >= 0) {
+    if (header) printf("\t%15.15s", "MPKI");
+    else printf("\t%15.3f", (ev[1] > 0.0) ? 1000.0 * ev[2] / ev[1] : 0.0);
+  }
+}
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
@@ -79,12 +229,100 @@ char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
 /// Cpu_time read on previous reset (~seconds)
 double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Wall_time read on previous reset (~seconds)
+double InstrWallTime;  ///extern
+
+/// Calibrated Time Unit (in seconds, initially 1s; see InstrGetCTU)
 double InstrCTU = 1.0;  ///extern
 
+// Has InstrCTU been calibrated (or read from the cache)?
+static int instrCalibrated = 0;
+
+// Path of the CTU cache file (NULL if there is no cache).
+// The cache is only used when asked for, so no file is ever written unasked.
+static const char* instrCachePath(void) {
+  const char* env = getenv("INSTR_CTU_CACHE");
+  return (env != NULL && *env != '\0') ? env : NULL;
+}
+
+// Cpu model (the key of the cache), in buf.
+static void instrCpuModel(char* buf, size_t size) {
+  snprintf(buf, size, "unknown");
+#ifdef __linux__
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL) return;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* colon = strchr(line, ':');
+    if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+      colon += strspn(colon + 1, " \t") + 1;
+      colon[strcspn(colon, "\n")] = '\0';
+      snprintf(buf, size, "%s", colon);
+      break;
+    }
+  }
+  fclose(f);
+#endif
+}
+
+// Read the CTU of this cpu model from the cache.  Returns 1 if found.
+// Each line of the cache file has a CTU and the cpu model it was measured on.
+static int instrLoadCTU(double* ctu) {
+  char model[256], line[512];
+  const char* file = instrCachePath();
+  if (file == NULL) return 0;
+  FILE* f = fopen(file, "r");
+  if (f == NULL) return 0;
+  instrCpuModel(model, sizeof(model));
+  int found = 0;
+  while (!found && fgets(line, sizeof(line), f) != NULL) {
+    double value;
+    int pos;
+    line[strcspn(line, "\n")] = '\0';
+    if (sscanf(line, "%lf\t%n", &value, &pos) == 1 && value > 0.0 &&
+        strcmp(line + pos, model) == 0) {
+      *ctu = value;
+      found = 1;
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+// Save the CTU of this cpu model to the cache, keeping the other models.
+// The new file is written aside and renamed, so readers never see it partial.
+static void instrSaveCTU(double ctu) {
+  char tmp[1100], model[256], line[512];
+  const char* file = instrCachePath();
+  if (file == NULL) return;
+  instrCpuModel(model, sizeof(model));
+  snprintf(tmp, sizeof(tmp), "%s.%lu.tmp", file, (unsigned long)(wall_time()*1e6));
+  FILE* out = fopen(tmp, "w");
+  if (out == NULL) return;
+  FILE* in = fopen(file, "r");
+  if (in != NULL) {
+    while (fgets(line, sizeof(line), in) != NULL) {
+      int pos = 0;
+      double value;
+      char copy[512];
+      snprintf(copy, sizeof(copy), "%s", line);
+      copy[strcspn(copy, "\n")] = '\0';
+      if (sscanf(copy, "%lf\t%n", &value, &pos) == 1 && strcmp(copy + pos, model) == 0)
+        continue;  // replaced below
+      fputs(line, out);
+    }
+    fclose(in);
+  }
+  fprintf(out, "%.9f\t%s\n", ctu, model);
+  if (fclose(out) != 0 || rename(tmp, file) != 0)
+    remove(tmp);
+}
+
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
+/// This takes a few seconds, so the result is saved in the CTU cache file,
+/// if there is one (see InstrGetCTU).  Call it to force a new calibration.
 void InstrCalibrate(void) { ///
   const int size = 4*1024;     // 2^12!
   const int mask = size - 1;
@@ -99,31 +337,149 @@ void InstrCalibrate(void) { ///
     //printf("%d %d %d\n", i, j, k);  // debug
   }
   InstrCTU = cpu_time() - time;
+  instrCalibrated = 1;
+  instrSaveCTU(InstrCTU);
 }
 
-/// Reset counters to zero and store cpu_time.
+/// Get the Calibrated Time Unit, calibrating only if needed.
+double InstrGetCTU(void) { ///
+  if (!instrCalibrated) {
+    if (getenv("INSTR_RECALIBRATE") == NULL && instrLoadCTU(&InstrCTU))
+      instrCalibrated = 1;
+    else
+      InstrCalibrate();
+  }
+  return InstrCTU;
+}
+
+// Times of the operations timed since the last reset, by name
+#define NUMOPS 64
+static struct {
+  const char* name;
+  unsigned long calls;
+  double time;
+  double walltime;
+  double events[NUMEVENTS];
+} instrOps[NUMOPS];
+static int instrNumOps = 0;
+static atomic_flag instrOpsLock = ATOMIC_FLAG_INIT;
+
+// Start times of the current operation of each thread
+static _Thread_local double instrOpTime;
+static _Thread_local double instrOpWallTime;
+static _Thread_local double instrOpEvents[NUMEVENTS];
+
+/// Reset counters, events and operation times to zero and store cpu_time and wall_time.
 void InstrReset(void) { ///
+  if (instrNumEvents < 0) instrOpenEvents();
+  for (struct instrBlock* b = atomic_load(&instrBlocks); b != NULL; b = b->next)
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      b->count[i] = 0ul;
   for (int i = 0; i < NUMCOUNTERS; i++)
-    InstrCount[i] = 0ul;
+    instrSpare.count[i] = 0ul;
+  while (atomic_flag_test_and_set(&instrOpsLock)) {}
+  instrNumOps = 0;
+  atomic_flag_clear(&instrOpsLock);
+  instrReadEvents(instrEvents0);
   InstrTime = cpu_time();
+  InstrWallTime = wall_time();
+}
+
+/// Start timing an operation in the calling thread.
+void InstrOpStart(void) { ///
+  instrReadEvents(instrOpEvents);
+  instrOpTime = cpu_time();
+  instrOpWallTime = wall_time();
+}
+
+/// Stop timing the operation started by InstrOpStart in the calling thread,
+/// and add its cpu and wall-clock times to the totals of the operations
+/// with the given name (which must remain valid until the next reset).
+void InstrOpStop(const char* name) { ///
+  double time = cpu_time() - instrOpTime;
+  double walltime = wall_time() - instrOpWallTime;
+  double events[NUMEVENTS];
+  instrReadEvents(events);
+  while (atomic_flag_test_and_set(&instrOpsLock)) {}
+  int i = 0;
+  while (i < instrNumOps && strcmp(instrOps[i].name, name) != 0)
+    i++;
+  if (i == instrNumOps && instrNumOps < NUMOPS) {
+    instrOps[i].name = name;
+    instrOps[i].calls = 0ul;
+    instrOps[i].time = 0.0;
+    instrOps[i].walltime = 0.0;
+    for (int j = 0; j < NUMEVENTS; j++)
+      instrOps[i].events[j] = 0.0;
+    instrNumOps++;
+  }
+  if (i < instrNumOps) {  // (if the table is full, the operation is ignored)
+    instrOps[i].calls++;
+    instrOps[i].time += time;
+    instrOps[i].walltime += walltime;
+    for (int j = 0; j < NUMEVENTS; j++)
+      instrOps[i].events[j] += events[j] - instrOpEvents[j];
+  }
+  atomic_flag_clear(&instrOpsLock);
+}
+
+/// Get the values of all counters, added up over all threads.
+void InstrTotals(unsigned long count[NUMCOUNTERS]) { ///
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    count[i] = instrSpare.count[i];
+  for (struct instrBlock* b = atomic_load(&instrBlocks); b != NULL; b = b->next)
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      count[i] += b->count[i];
 }
 
 // Print times and all named counter values
 void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
+  double walltime = wall_time() - InstrWallTime;
+  double events[NUMEVENTS];
+  instrReadEvents(events);
+  for (int i = 0; i < NUMEVENTS; i++)
+    events[i] -= instrEvents0[i];
   // compute time in calibrated time units:
-  double caltime = time / InstrCTU;
+  double caltime = time / InstrGetCTU();
+  // add up the counters of all threads:
+  unsigned long count[NUMCOUNTERS];
+  InstrTotals(count);
 
-  printf("#%14.15s\t%15.15s", "time", "caltime");
+  printf("#%14.15s\t%15.15s\t%15.15s", "time", "caltime", "walltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
   puts("");
-  printf("%15.6f\t%15.6f", time, caltime);
+  printf("%15.6f\t%15.6f\t%15.6f", time, caltime, walltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
+      printf("\t%15lu", count[i]);  
   puts("");
+
+  // hardware events:
+  if (instrNumEvents > 0) {
+    printf("#");
+    instrPrintEvents(events, 1);
+    puts("");
+    instrPrintEvents(events, 0);
+    puts("");
+  }
+
+  // times of each operation:
+  while (atomic_flag_test_and_set(&instrOpsLock)) {}
+  if (instrNumOps > 0) {
+    printf("#%14.15s\t%15.15s\t%15.15s\t%15.15s", "operation", "calls", "time", "walltime");
+    if (instrNumEvents > 0) instrPrintEvents(NULL, 1);
+    puts("");
+  }
+  for (int i = 0; i < instrNumOps; i++) {
+    printf("%15.15s\t%15lu\t%15.6f\t%15.6f", instrOps[i].name,
+           instrOps[i].calls, instrOps[i].time, instrOps[i].walltime);
+    if (instrNumEvents > 0) instrPrintEvents(instrOps[i].events, 0);
+    puts("");
+  }
+  atomic_flag_clear(&instrOpsLock);
 }
 
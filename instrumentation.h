@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: measure CTU now (else, done when needed)
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,18 +18,35 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// To see how time is distributed among the parts of a program:
+/// InstrOpStart();
+/// ...
+/// InstrOpStop("part1");  // InstrPrint shows the times of each part
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
-/// Cpu time in seconds
+/// Cpu time in seconds (of all threads of the process)
 double cpu_time(void) ; ///
 
+/// Wall-clock (elapsed real) time in seconds
+double wall_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (of the calling thread):
+/// Each thread counts in its own block of counters, so that threads may
+/// count without locking.  InstrPrint adds up the blocks of all threads,
+/// and InstrReset resets them all.
+#define InstrCount (InstrBlock != NULL ? InstrBlock : InstrNewBlock())
+
+/// Block of counters of the calling thread (NULL until first used).
+extern _Thread_local unsigned long* InstrBlock;  ///extern
+
+/// Create the block of counters of the calling thread.
+unsigned long* InstrNewBlock(void) ;
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
@@ -37,18 +54,63 @@ extern char* InstrName[NUMCOUNTERS];  ///extern
 /// Cpu_time read on previous reset (~seconds)
 extern double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Wall_time read on previous reset (~seconds)
+extern double InstrWallTime;  ///extern
+
+/// Calibrated Time Unit (in seconds, initially 1s; see InstrGetCTU)
 extern double InstrCTU;  ///extern
 
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
+/// This takes a few seconds, so the result is saved in the CTU cache file,
+/// if there is one (see InstrGetCTU).  Call it to force a new calibration.
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Get the Calibrated Time Unit, calibrating only if needed.
+/// If environment variable INSTR_CTU_CACHE names a file, the CTU of each
+/// cpu model is cached there (by default, there is no cache).
+/// If it is not cached (or environment variable INSTR_RECALIBRATE is set),
+/// InstrCalibrate is called.  InstrPrint uses this.
+double InstrGetCTU(void) ;
+
+/// Hardware events counted by the cpu, where available
+/// (Linux perf_event_open): cycles, instructions, cache misses and
+/// branch misses, of the thread that opened them and of all threads it
+/// creates afterwards (so that work done by worker threads is counted).
+/// They are opened by InstrEvents or by the first InstrReset, whichever
+/// comes first, unless environment variable INSTR_PERF is "0": to count
+/// the events of worker threads, call InstrEvents before creating them.
+/// Event counts read by any thread are the totals of all those threads.
+/// If they are not available (not Linux, no permission, no hardware
+/// counters), they are simply not shown by InstrPrint.
+#define NUMEVENTS 4
+
+/// Names of the hardware events:
+extern const char* InstrEventName[NUMEVENTS];  ///extern
+
+/// Number of hardware events available (0 if none).
+int InstrEvents(void) ;
+
+/// Reset counters, events and operation times to zero and store cpu_time and wall_time.
 void InstrReset(void) ;
 
+/// Get the values of all counters, added up over all threads.
+void InstrTotals(unsigned long count[NUMCOUNTERS]) ;
+
+/// Print times and all named counter values, added up over all threads,
+/// and the hardware events with instructions per cycle (IPC) and cache
+/// misses per thousand instructions (MPKI), if available,
+/// followed by the times (and IPC and MPKI) of each operation (see InstrOpStop).
 void InstrPrint(void) ;
 
+/// Start timing an operation in the calling thread.
+void InstrOpStart(void) ;
+
+/// Stop timing the operation started by InstrOpStart in the calling thread,
+/// and add its cpu and wall-clock times to the totals of the operations
+/// with the given name (which must remain valid until the next reset).
+void InstrOpStop(const char* name) ;
+
 #endif
 